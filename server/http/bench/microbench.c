@@ -0,0 +1,244 @@
+/*
+ * Microbenchmarks for the request parser and response builders.
+ *
+ * Every benchmark reports ns/op and allocations/op. Instructions and cache
+ * misses per op are reported as well when perf_event_open is permitted.
+ *
+ * Usage: bin/microbench bench/corpus/<capture>.req...
+ */
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "logger.h"
+#include "requests.h"
+#include "response.h"
+#include "utils.h"
+
+#define MAX_CORPUS 64
+#define MIN_BENCH_NS 200000000L  // run every benchmark for at least 200ms
+
+int DEBUG_F = 0;
+char WEBBY_ROOT[MAX_BUFFER];
+
+/*
+ * Allocation counting. The binary is linked with -Wl,--wrap=malloc so every
+ * malloc call made by the code under test goes through here.
+ */
+static unsigned long alloc_count = 0;
+
+void *__real_malloc(size_t);
+void *__wrap_malloc(size_t size) {
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+struct request_capture {
+    char name[64];
+    char data[MAX_BUFFER];
+    int len;
+};
+
+static struct request_capture corpus[MAX_CORPUS];
+static int corpus_len = 0;
+
+/* Result sink so the compiler can not drop the benchmarked calls */
+static volatile long sink;
+
+/*
+ * Hardware counters, opened as a group so that they are read together.
+ */
+static int perf_fds[2] = {-1, -1};
+
+static int perf_open(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void perf_setup() {
+    perf_fds[0] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, -1);
+    if (perf_fds[0] == -1) {
+        fprintf(stderr, "perf_event_open not permitted, skipping hardware counters\n");
+        return;
+    }
+    perf_fds[1] = perf_open(PERF_COUNT_HW_CACHE_MISSES, perf_fds[0]);
+}
+
+static void perf_start() {
+    if (perf_fds[0] == -1) return;
+    ioctl(perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/*
+ * Stop the counters and read instructions into counts[0] and cache misses
+ * into counts[1]. Unavailable counters are set to -1.
+ */
+static void perf_stop(long counts[2]) {
+    uint64_t values[3] = {0};
+
+    counts[0] = counts[1] = -1;
+    if (perf_fds[0] == -1) return;
+    ioctl(perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fds[0], values, sizeof(values)) < 0) return;
+    if (values[0] >= 1) counts[0] = values[1];
+    if (values[0] >= 2) counts[1] = values[2];
+}
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+typedef void (*bench_fn)(long);
+
+/*
+ * Run fn with a growing iteration count until it takes at least MIN_BENCH_NS,
+ * then print the per op numbers of the last run.
+ */
+static void run_bench(const char *name, bench_fn fn) {
+    long iters = 1, elapsed = 0, counts[2];
+    unsigned long allocs = 0;
+
+    fn(1);  // warm up
+    for (;;) {
+        alloc_count = 0;
+        perf_start();
+        long start = now_ns();
+        fn(iters);
+        elapsed = now_ns() - start;
+        perf_stop(counts);
+        allocs = alloc_count;
+        if (elapsed >= MIN_BENCH_NS || iters >= 1L << 30) break;
+        iters *= elapsed > 0 && MIN_BENCH_NS / elapsed < 10 ? 2 : 10;
+    }
+
+    fprintf(stderr, "%-28s %10ld %10.1f %10.2f", name, iters, (double)elapsed / iters,
+            (double)allocs / iters);
+    for (int c = 0; c < 2; c++) {
+        if (counts[c] < 0)
+            fprintf(stderr, " %12s", "-");
+        else
+            fprintf(stderr, " %12.1f", (double)counts[c] / iters);
+    }
+    fprintf(stderr, "\n");
+}
+
+static void bench_parse_request_line(long iters) {
+    struct http_request_info hri;
+    for (long i = 0; i < iters; i++) {
+        sink = parse_request_line(corpus[i % corpus_len].data, &hri);
+    }
+}
+
+static void bench_read_all_headers(long iters) {
+    struct http_request_info hri;
+    for (long i = 0; i < iters; i++) {
+        struct request_capture *rc = &corpus[i % corpus_len];
+        read_all_headers(rc->data, parse_request_line(rc->data, &hri), rc->len);
+    }
+}
+
+static void bench_build_http_status(long iters) {
+    for (long i = 0; i < iters; i++) {
+        char *s = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeOk);
+        sink = s[0];
+        free(s);
+    }
+}
+
+static void bench_format_response_head(long iters) {
+    char buf[MAX_BUFFER];
+    for (long i = 0; i < iters; i++) {
+        sink = format_response_head(buf, sizeof(buf), "HTTP/1.1 200 OK", "text/html", 68);
+    }
+}
+
+static void bench_get_server_date(long iters) {
+    for (long i = 0; i < iters; i++) {
+        char *s = get_server_date();
+        sink = s[0];
+        free(s);
+    }
+}
+
+static void bench_logger_f_debug_off(long iters) {
+    for (long i = 0; i < iters; i++) {
+        log_debug("Request info: method: %s uri: %s proto: %s", "GET", "/index.html",
+                  "HTTP/1.1");
+    }
+}
+
+static void bench_logger_f_info(long iters) {
+    for (long i = 0; i < iters; i++) {
+        log_info("Request info: method: %s uri: %s proto: %s", "GET", "/index.html", "HTTP/1.1");
+    }
+}
+
+/*
+ * Load a request capture, NUL terminated the same way handle_client() leaves it.
+ */
+static int load_capture(const char *path) {
+    if (corpus_len == MAX_CORPUS) return -1;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    struct request_capture *rc = &corpus[corpus_len];
+    memset(rc->data, 0, sizeof(rc->data));
+    rc->len = fread(rc->data, 1, MAX_BUFFER - 1, f);
+    fclose(f);
+
+    const char *base = strrchr(path, '/');
+    snprintf(rc->name, sizeof(rc->name), "%s", base != NULL ? base + 1 : path);
+    corpus_len++;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (load_capture(argv[i]) != 0) {
+            fprintf(stderr, "Could not load request capture: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (corpus_len == 0) {
+        fprintf(stderr, "Usage: %s <request capture>...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // log_info() writes to stdout, results are printed on stderr
+    if (freopen("/dev/null", "w", stdout) == NULL) exit(EXIT_FAILURE);
+
+    perf_setup();
+
+    fprintf(stderr, "%d request captures:", corpus_len);
+    for (int i = 0; i < corpus_len; i++) fprintf(stderr, " %s", corpus[i].name);
+    fprintf(stderr, "\n\n%-28s %10s %10s %10s %12s %12s\n", "benchmark", "iters", "ns/op",
+            "allocs/op", "instrs/op", "misses/op");
+
+    run_bench("parse_request_line", bench_parse_request_line);
+    run_bench("read_all_headers", bench_read_all_headers);
+    run_bench("build_http_status", bench_build_http_status);
+    run_bench("format_response_head", bench_format_response_head);
+    run_bench("get_server_date", bench_get_server_date);
+    run_bench("logger_f (debug, off)", bench_logger_f_debug_off);
+    run_bench("logger_f (info)", bench_logger_f_info);
+    return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * Fuzz harness for the request parser and the uri decoder.
+ *
+ * Built for libFuzzer by default. With -DFUZZ_STANDALONE it gets a main()
+ * which reads one input from stdin or from each file argument, which is what
+ * AFL-style fuzzers and crash reproduction need.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "requests.h"
+
+int DEBUG_F = 0;
+char WEBBY_ROOT[MAX_BUFFER];
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // same buffer handle_client() reads the request into
+    char read_buffer[MAX_BUFFER] = {0};
+    if (size > MAX_BUFFER - 1) size = MAX_BUFFER - 1;
+    memcpy(read_buffer, data, size);
+
+    struct http_request_info hri;
+    int headers_start = parse_request_line(read_buffer, &hri);
+    read_all_headers(read_buffer, headers_start, size);
+
+    // as send_resource() decodes it, and into a buffer too small for most paths
+    char uri_path[MAX_URI], short_path[16];
+    uri_decode(hri.uri, uri_path, sizeof(uri_path));
+    uri_decode(hri.uri, short_path, sizeof(short_path));
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+static int run_file(FILE *f) {
+    uint8_t data[MAX_BUFFER];
+    size_t size = fread(data, 1, sizeof(data), f);
+    return LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) return run_file(stdin);
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (f == NULL) {
+            perror(argv[i]);
+            return 1;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,199 @@
+#include "admission.h"
+
+#include <stdlib.h>
+#include <sys/random.h>
+
+#include "defaults.h"
+#include "logger.h"
+#include "utils.h"
+
+struct admission_conn {
+    int open;     // counted as an open connection
+    int tracked;  // request admitted and counted as in flight
+    int shed;
+};
+
+struct rate_bucket {
+    in_addr_t ip;
+    int used;
+    double tokens;
+    uint64_t last_ns;
+};
+
+static struct admission_conn *conns = NULL;
+static int conns_len = 0;
+
+static int open_conns = 0;
+static int max_open = 0;
+static int in_flight = 0;
+static int max_connections = 0;
+static int rate_limit = 0;
+
+static struct rate_bucket rate_buckets[ADMISSION_RATE_BUCKETS];
+static uint32_t rate_seed = 0;  // keeps clients from picking addresses which share a set
+
+/* CoDel state: when the queue delay first went above target, and whether it stayed there */
+static uint64_t first_above_ns = 0;
+static int overloaded = 0;
+
+/**
+ * Set up admission control. Open connections are capped below the open files
+ * limit, leaving an fd for the body of each response and RESERVED_FDS for the
+ * server itself, so accept() does not run out of fds.
+ *
+ * @max_conns: requests in flight at once, more get a 503
+ * @rate     : requests per second per client IP, 0 for no limit
+ */
+int admission_init(int max_conns, int rate) {
+    int size = fd_table_size();
+
+    conns = (struct admission_conn *)calloc(size, sizeof(struct admission_conn));
+    if (conns == NULL) {
+        log_error("Could not allocate admission table");
+        return -1;
+    }
+    conns_len = size;
+    max_open = (size - RESERVED_FDS) / 2;
+    if (max_open < 1) max_open = 1;
+    log_info("Accepting up to %d open connections", max_open);
+
+    if (getrandom(&rate_seed, sizeof(rate_seed), GRND_NONBLOCK) != sizeof(rate_seed)) {
+        rate_seed = monotonic_ns();
+    }
+    max_connections = max_conns;
+    rate_limit = rate;
+    return 0;
+}
+
+/*
+ * Tokens in b at now, refilled at rate_limit tokens per second up to a burst of
+ * one second worth.
+ */
+static double rate_tokens(const struct rate_bucket *b, uint64_t now) {
+    double tokens = b->tokens + (double)(now - b->last_ns) / 1e9 * rate_limit;
+    return tokens > rate_limit ? rate_limit : tokens;
+}
+
+/*
+ * Take a token from the bucket of ip. Buckets are grouped in sets of
+ * ADMISSION_RATE_WAYS picked by a seeded hash of ip. A client without a bucket
+ * takes over the least recently used one of its set along with its tokens, so
+ * evicting a busy client never hands out a fresh burst.
+ */
+static int rate_allow(in_addr_t ip, uint64_t now) {
+    if (rate_limit <= 0) return 1;
+
+    uint32_t h = ((uint32_t)ip ^ rate_seed) * 2654435761u;  // Knuth multiplicative hash
+    int sets = ADMISSION_RATE_BUCKETS / ADMISSION_RATE_WAYS;
+    struct rate_bucket *set = &rate_buckets[((h >> 16) & (sets - 1)) * ADMISSION_RATE_WAYS];
+    struct rate_bucket *b = NULL, *lru = &set[0];
+
+    for (int i = 0; i < ADMISSION_RATE_WAYS; i++) {
+        struct rate_bucket *e = &set[i];
+        if (e->used && e->ip == ip) {
+            b = e;
+            break;
+        }
+        if (lru->used && (!e->used || e->last_ns < lru->last_ns)) lru = e;
+    }
+
+    if (b != NULL) {
+        b->tokens = rate_tokens(b, now);
+    } else {
+        b = lru;
+        b->tokens = b->used ? rate_tokens(b, now) : rate_limit;
+        b->used = 1;
+        b->ip = ip;
+    }
+    b->last_ns = now;
+
+    if (b->tokens < 1) return 0;
+    b->tokens -= 1;
+    return 1;
+}
+
+/*
+ * CoDel-style overload detection. The server is overloaded once the queue
+ * delay has stayed above CODEL_TARGET_NS for a whole CODEL_INTERVAL_NS, and
+ * stops being overloaded as soon as a request gets through under target.
+ */
+static void codel_update(uint64_t delay_ns, uint64_t now) {
+    if (delay_ns < CODEL_TARGET_NS) {
+        first_above_ns = 0;
+        if (overloaded) {
+            overloaded = 0;
+            log_info("Queue delay back under target, admitting all requests");
+        }
+        return;
+    }
+    if (first_above_ns == 0) {
+        first_above_ns = now;
+    } else if (!overloaded && now - first_above_ns >= CODEL_INTERVAL_NS) {
+        overloaded = 1;
+        log_info("Queue delay above %dms for %dms, shedding delayed requests",
+                 CODEL_TARGET_NS / 1000000, CODEL_INTERVAL_NS / 1000000);
+    }
+}
+
+/**
+ * Decide whether a freshly accepted connection is served, based on the number
+ * of open connections and the request rate of the client. A connection which
+ * can not be tracked is always rejected.
+ */
+enum admission_verdict admission_accept(int fd, const struct sockaddr_in *addr) {
+    if (fd < 0 || fd >= conns_len || open_conns >= max_open) {
+        log_debug("Too many open connections: %d, rejecting fd: %d", open_conns, fd);
+        return AdmissionReject;
+    }
+
+    struct admission_conn *c = &conns[fd];
+    c->open = 1;
+    c->tracked = 0;
+    c->shed = 0;
+    open_conns++;
+
+    if (!rate_allow(addr->sin_addr.s_addr, monotonic_ns())) {
+        log_debug("Rate limit reached for client, shedding fd: %d", fd);
+        c->shed = 1;
+        return AdmissionShed;
+    }
+    return AdmissionAdmit;
+}
+
+/**
+ * Decide whether a request which waited delay_ns in the socket before being
+ * read is served. A negative delay means it could not be measured.
+ *
+ * Only requests which have been read count as in flight, so connections which
+ * stay idle can not hold the server at max_connections.
+ */
+enum admission_verdict admission_request(int fd, int64_t delay_ns) {
+    if (fd < 0 || fd >= conns_len || conns[fd].shed) return AdmissionShed;
+
+    if (delay_ns >= 0) {
+        codel_update(delay_ns, monotonic_ns());
+
+        // requests which already missed the target make room for the ones which still can
+        if (overloaded && delay_ns > CODEL_TARGET_NS) return AdmissionShed;
+    }
+
+    if (in_flight >= max_connections) {
+        log_debug("Too many requests in flight: %d, shedding fd: %d", in_flight, fd);
+        return AdmissionShed;
+    }
+    conns[fd].tracked = 1;
+    in_flight++;
+    return AdmissionAdmit;
+}
+
+/**
+ * Forget about a connection which is being closed.
+ */
+void admission_release(int fd) {
+    if (fd < 0 || fd >= conns_len) return;
+    if (conns[fd].open) open_conns--;
+    if (conns[fd].tracked) in_flight--;
+    conns[fd].open = 0;
+    conns[fd].tracked = 0;
+    conns[fd].shed = 0;
+}
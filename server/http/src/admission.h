@@ -0,0 +1,23 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#define ADMISSION_RATE_BUCKETS 4096  // per client IP token buckets, must be a power of two
+#define ADMISSION_RATE_WAYS 8        // buckets per hash set, least recently used one is evicted
+#define CODEL_TARGET_NS 5000000      // acceptable queue delay: 5ms
+#define CODEL_INTERVAL_NS 100000000  // delay above target for this long means overload: 100ms
+
+enum admission_verdict {
+    AdmissionAdmit = 0,
+    AdmissionShed = 1,    // answer the request with a 503 once it arrives
+    AdmissionReject = 2,  // too many connections open, answer with a 503 and close right away
+};
+
+int admission_init(int, int);
+enum admission_verdict admission_accept(int, const struct sockaddr_in *);
+enum admission_verdict admission_request(int, int64_t);
+void admission_release(int);
+
+#endif /* ADMISSION_H */
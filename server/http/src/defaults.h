@@ -7,5 +7,10 @@
 #define APP_NAME "Webby"
 #define APP_VERSION "0.4.0"
 #define MAX_EVENTS 10
+#define TRACE_ROUTE "/_webby/trace"  // admin route serving the trace ring when tracing
+#define MAX_CONNECTIONS 1024  // requests in flight before new ones get a 503
+#define RETRY_AFTER 1         // seconds, sent along with a 503
+#define MAX_FD_TABLE 1048576  // cap on fd indexed tables when RLIMIT_NOFILE is unlimited
+#define RESERVED_FDS 8        // fds kept for the listen socket, epoll, logs and trace dumps
 
 #endif /* DEFAULT_PORT */
@@ -0,0 +1,94 @@
+#include "requests.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "defaults.h"
+#include "logger.h"
+
+/**
+ * Parse the request line at the start of read_buffer into hri. Fields which
+ * are missing from the request are left empty.
+ *
+ * Return the index where the headers start.
+ */
+int parse_request_line(const char *read_buffer, struct http_request_info *hri) {
+    hri->method[0] = hri->uri[0] = hri->proto[0] = '\0';
+
+    // field widths are MAX_METHOD, MAX_URI and MAX_PROTO less the terminating NUL
+    sscanf(read_buffer, "%7s %4095s %15s", hri->method, hri->uri, hri->proto);
+
+    return strlen(hri->method) + strlen(hri->uri) + strlen(hri->proto) + 4;
+}
+
+/**
+ * Decode the percent-escapes of uri into out. A malformed escape is copied as is.
+ *
+ * Return -1 if uri holds an escaped NUL or does not fit in out, 0 otherwise.
+ */
+int uri_decode(const char *uri, char *out, size_t size) {
+    size_t j = 0;
+    for (; *uri != '\0'; uri++) {
+        if (j + 1 >= size) {
+            out[j] = '\0';
+            return -1;
+        }
+        unsigned int c;
+        if (uri[0] == '%' && isxdigit((unsigned char)uri[1]) && isxdigit((unsigned char)uri[2]) &&
+            sscanf(uri + 1, "%2x", &c) == 1) {
+            if (c == 0) {
+                out[j] = '\0';
+                return -1;
+            }
+            out[j++] = c;
+            uri += 2;
+        } else {
+            out[j++] = *uri;
+        }
+    }
+    out[j] = '\0';
+    return 0;
+}
+
+/**
+ * Naive implementation for reading all headers
+ *
+ * @read_buffer: buffer to read from
+ * @start      : index to start reading from
+ * @stop       : max index to read until
+ */
+void read_all_headers(const char *read_buffer, int start, int stop) {
+    char buf[MAX_BUFFER];
+
+    char k[MAX_BUFFER], v[MAX_BUFFER];
+    int key_found = 0;
+
+    memset(buf, 0, sizeof(char) * MAX_BUFFER);
+    k[0] = '\0';
+    if (start < 1) start = 1;
+
+    for (int i = start, j = 0; i < stop; i++) {
+        if ((read_buffer[i - 1] == '\r') && (read_buffer[i] == '\n')) {
+            memset(v, '\0', sizeof(char) * MAX_BUFFER);
+            if (strlen(buf) > 0)
+                strcpy(v, buf);
+            else
+                continue;  // nothing in buf to copy
+            log_debug("Header: %s => %s", k, v);
+            memset(buf, '\0', sizeof(char) * MAX_BUFFER);
+            key_found = 0, j = 0;
+            if ((i + 1 < stop) && (read_buffer[i + 1] == '\r')) {
+                break;
+            }
+            continue;
+        }
+        if (j < MAX_BUFFER - 1) buf[j++] = read_buffer[i];  // overlong lines are truncated
+        if ((buf[j - 1] == ':') && !key_found) {
+            memset(k, '\0', sizeof(char) * MAX_BUFFER);
+            strcpy(k, buf);
+            key_found = 1, j = 0, i++;
+            memset(buf, '\0', sizeof(char) * MAX_BUFFER);
+        }
+    }
+}
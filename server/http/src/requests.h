@@ -1,16 +1,24 @@
 #ifndef REQUESTS_H
 #define REQUESTS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MAX_URI 4096
 #define MAX_METHOD 8
 #define MAX_PROTO 16
 
 struct http_request_info {
-    int fd;  // conn fd
+    int fd;             // conn fd
+    uint64_t start_ns;  // when the request was picked up, for the request trace span
 
     char uri[MAX_URI];
     char method[MAX_METHOD];
     char proto[MAX_PROTO];
 };
 
+int parse_request_line(const char *, struct http_request_info *);
+void read_all_headers(const char *, int, int);
+int uri_decode(const char *, char *, size_t);
+
 #endif /* REQUESTS_H */
@@ -1,12 +1,17 @@
 #include "response.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>  // for free
 #include <string.h>
+#include <time.h>
 
 #include "defaults.h"
 #include "logger.h"
+#include "stream.h"
+#include "trace.h"
 #include "utils.h"
 
 char not_found_response[] =
@@ -16,6 +21,13 @@ char not_found_response[] =
     "<p style='font-family:\"Lucida Console\", monospace'>Powered by Webby</p>"
     "</body></html>";
 
+char service_unavailable_response[] =
+    "<title>Webby - 503</title>"
+    "<html><body><h1>503 Service Unavailable</h1>"
+    "<h3><i>Sorry, the server is too busy right now, please try again</h3><hr>"
+    "<p style='font-family:\"Lucida Console\", monospace'>Powered by Webby</p>"
+    "</body></html>";
+
 /**
  * Example response html
  */
@@ -28,6 +40,8 @@ char *http_content_type_string(enum http_content_type n) {
     switch (n) {
         case HttpContentType_TextHtml:
             return "text/html";
+        case HttpContentType_ApplicationJson:
+            return "application/json";
         default:
             return "text/plain; charset=utf-8";
     }
@@ -76,6 +90,8 @@ const char *http_status_string(enum http_status_code n) {
             return "Not Implemented";
         case HttpStatusCodeBadGateway:
             return "Bad Gateway";
+        case HttpStatusCodeServiceUnvailable:
+            return "Service Unavailable";
         default:
             return "";
     }
@@ -92,6 +108,27 @@ char *build_http_status(enum http_proto p, enum http_status_code n) {
     return s;
 }
 
+/**
+ * Format the status line and headers of a response into buf.
+ *
+ * Return the length of the formatted head.
+ */
+int format_response_head(char *buf, size_t size, const char *http_status, char *content_type,
+                         int content_length) {
+    char *server_date = get_server_date();
+
+    int head_length = snprintf(buf, size,
+                               "%s\r\n"
+                               "Date: %s\r\n"
+                               "Server: %s\r\n"
+                               "Content-Length: %d\r\n"
+                               "Content-Type: %s\r\n"
+                               "\r\n",
+                               http_status, server_date, APP_NAME, content_length, content_type);
+    free(server_date);
+    return head_length;
+}
+
 /**
  * Send an HTTP response.
  *
@@ -101,19 +138,53 @@ int send_response(int fd, const char *http_status, char *content_type, void *bod
                   int content_length) {
     char response[MAX_RESPONSE_SIZE];
 
-    char *server_date = get_server_date();
-
-    int response_length = sprintf(response,
-                                  "%s\r\n"
-                                  "Date: %s\r\n"
-                                  "Server: %s\r\n"
-                                  "Content-Length: %d\r\n"
-                                  "Content-Type: %s\r\n"
-                                  "\r\n",
-                                  http_status, server_date, APP_NAME, content_length, content_type);
+    int response_length =
+        format_response_head(response, sizeof(response), http_status, content_type, content_length);
     memcpy(response + response_length, body, content_length);
-    free(server_date);
-    return send(fd, response, response_length + content_length, 0);
+
+    TRACE_BEGIN(send, fd);
+    int w = send(fd, response, response_length + content_length, 0);
+    TRACE_END(send, fd, w);
+    return w;
+}
+
+/**
+ * Send a 503 asking the client to retry later, in a single send() call.
+ * The response is prebuilt and only formatted again when its Date goes stale.
+ */
+int send_service_unavailable(int fd) {
+    static char response[MAX_BUFFER];
+    static int response_length = 0;
+    static time_t built_at = 0;
+
+    time_t now = time(NULL);
+    if (now != built_at) {
+        char *http_status = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeServiceUnvailable);
+        char *server_date = get_server_date();
+
+        response_length = snprintf(response, sizeof(response),
+                                   "%s\r\n"
+                                   "Date: %s\r\n"
+                                   "Server: %s\r\n"
+                                   "Retry-After: %d\r\n"
+                                   "Content-Length: %zu\r\n"
+                                   "Content-Type: %s\r\n"
+                                   "Connection: close\r\n"
+                                   "\r\n"
+                                   "%s",
+                                   http_status, server_date, APP_NAME, RETRY_AFTER,
+                                   strlen(service_unavailable_response),
+                                   http_content_type_string(HttpContentType_TextHtml),
+                                   service_unavailable_response);
+        free(http_status);
+        free(server_date);
+        built_at = now;
+    }
+
+    TRACE_BEGIN(send, fd);
+    int w = send(fd, response, response_length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    TRACE_END(send, fd, w);
+    return w;
 }
 
 size_t get_file_size(FILE *resource) {
@@ -133,54 +204,279 @@ char *strconcat(const char *s1, const char *s2) {
     return result;
 }
 
+struct file_body {
+    FILE *res;
+    long remaining;  // bytes left of the advertised Content-Length
+};
+
 /*
- * Read a file content from res and send that over fd with content type set to type.
- * It is assumed that the file exists and hence the HTTP status is set to OK. The check
- * for file presence is a responsibility of the caller.
+ * Pull the next chunk of a file into the stream, never going past the length
+ * which was advertised even if the file grows meanwhile.
  */
-int send_file_content(int fd, FILE *res, enum http_content_type type) {
-    char content[MAX_RESPONSE_SIZE];
-    size_t file_size = get_file_size(res);
+static enum http_stream_status produce_file(struct http_stream *s, void *ctx) {
+    struct file_body *fb = (struct file_body *)ctx;
+    char content[STREAM_CHUNK_SIZE];
 
-    log_debug("file size: %d bytes", file_size);
+    if (fb->remaining == 0) return HttpStreamDone;
 
-    char *ret_http_status = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeOk);
+    size_t want = http_stream_room(s);
+    if ((long)want > fb->remaining) want = fb->remaining;
 
-    size_t b = fread(content, 1, MAX_RESPONSE_SIZE, res);
+    TRACE_BEGIN(file_read, s->fd);
+    size_t b = fread(content, 1, want, fb->res);
+    TRACE_END(file_read, s->fd, b);
     log_debug("Read from file: %d bytes", b);
+    if (b == 0) {
+        // the file shrank, the advertised length can no longer be met
+        log_error("File ended %ld bytes short", fb->remaining);
+        return HttpStreamError;
+    }
 
-    int w = send_response(fd, ret_http_status, http_content_type_string(type), content, file_size);
-    free(ret_http_status);
-    return w;
+    http_stream_write(s, content, b);
+    fb->remaining -= b;
+    return HttpStreamMore;
 }
 
-/**
- * Send html response (chunked transfer not possible)
+static void release_file(void *ctx) {
+    struct file_body *fb = (struct file_body *)ctx;
+    fclose(fb->res);
+    free(fb);
+}
+
+/*
+ * Stream a file content from res over hri->fd with content type set to type.
+ * It is assumed that the file exists and hence the HTTP status is set to OK. The check
+ * for file presence is a responsibility of the caller. The stream takes ownership of res.
  */
-int send_html_response(int fd, struct http_request_info *hri) {
-    char *path = strconcat(WEBBY_ROOT, hri->uri);
-    FILE *res = fopen(path, "r");
+int send_file_content(struct http_request_info *hri, FILE *res, enum http_content_type type) {
+    struct file_body *fb = (struct file_body *)malloc(sizeof(struct file_body));
+    if (fb == NULL) {
+        fclose(res);
+        return -1;
+    }
+    fb->res = res;
+    fb->remaining = get_file_size(res);
+
+    log_debug("file size: %ld bytes", fb->remaining);
+
+    return http_stream_send(hri, HttpStatusCodeOk, http_content_type_string(type), fb->remaining,
+                            produce_file, release_file, fb);
+}
+
+struct dir_listing {
+    DIR *dir;
+    struct dirent *entry;  // entry which did not fit in the stream yet
+    int header_sent;
+    char uri[MAX_URI];
+};
+
+/*
+ * Copy s into out, escaping the characters which are special in html.
+ */
+static void html_escape(const char *s, char *out, size_t size) {
+    size_t j = 0;
+    for (; *s != '\0'; s++) {
+        const char *rep = NULL;
+        switch (*s) {
+            case '<':
+                rep = "&lt;";
+                break;
+            case '>':
+                rep = "&gt;";
+                break;
+            case '&':
+                rep = "&amp;";
+                break;
+            case '"':
+                rep = "&quot;";
+                break;
+            case '\'':
+                rep = "&#39;";
+                break;
+        }
+        size_t n = rep != NULL ? strlen(rep) : 1;
+        if (j + n >= size) break;
+        if (rep != NULL)
+            memcpy(out + j, rep, n);
+        else
+            out[j] = *s;
+        j += n;
+    }
+    out[j] = '\0';
+}
+
+/*
+ * Copy s into out, percent-encoding everything but unreserved characters and,
+ * if keep_slash is set, the path separators.
+ */
+static void url_encode(const char *s, char *out, size_t size, int keep_slash) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t j = 0;
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~' ||
+            (keep_slash && c == '/')) {
+            if (j + 1 >= size) break;
+            out[j++] = c;
+        } else {
+            if (j + 3 >= size) break;
+            out[j++] = '%';
+            out[j++] = hex[c >> 4];
+            out[j++] = hex[c & 0xf];
+        }
+    }
+    out[j] = '\0';
+}
+
+/*
+ * Generate the directory listing one entry at a time.
+ */
+static enum http_stream_status produce_dir_listing(struct http_stream *s, void *ctx) {
+    struct dir_listing *dl = (struct dir_listing *)ctx;
+
+    if (!dl->header_sent) {
+        char uri[MAX_URI];
+        html_escape(dl->uri, uri, sizeof(uri));
+        if (http_stream_printf(s,
+                               "<title>Webby - Index of %s</title>"
+                               "<html><body><h1>Index of %s</h1><hr><pre>\r\n",
+                               uri, uri) == 0)
+            return HttpStreamMore;
+        dl->header_sent = 1;
+    }
+
+    if (dl->entry == NULL) dl->entry = readdir(dl->dir);
+    if (dl->entry == NULL) {
+        if (http_stream_printf(s, "</pre><hr><p style='font-family:\"Lucida Console\", "
+                                  "monospace'>Powered by Webby</p></body></html>\r\n") == 0)
+            return HttpStreamMore;
+        return HttpStreamDone;
+    }
+
+    const char *d_name = dl->entry->d_name;
+    int at_root = strcmp(dl->uri, "/") == 0;
+    if (strcmp(d_name, ".") != 0 && !(at_root && strcmp(d_name, "..") == 0)) {
+        char href_dir[MAX_URI], href_name[MAX_BUFFER], name[MAX_BUFFER];
+        size_t len = strlen(dl->uri);
+        const char *sep = len > 0 && dl->uri[len - 1] == '/' ? "" : "/";
+
+        // percent-encoded links only hold characters which are safe in html as well
+        url_encode(dl->uri, href_dir, sizeof(href_dir), 1);
+        url_encode(d_name, href_name, sizeof(href_name), 0);
+        html_escape(d_name, name, sizeof(name));
+        if (http_stream_printf(s, "<a href=\"%s%s%s\">%s</a>\r\n", href_dir, sep, href_name,
+                               name) == 0)
+            return HttpStreamMore;
+    }
+    dl->entry = NULL;
+    return HttpStreamMore;
+}
+
+static void release_dir_listing(void *ctx) {
+    struct dir_listing *dl = (struct dir_listing *)ctx;
+    closedir(dl->dir);
+    free(dl);
+}
+
+/*
+ * Stream an html listing of dir, found at the decoded uri path, over hri->fd. The
+ * length is not known up front so the listing is sent chunked. The stream takes
+ * ownership of dir.
+ */
+int send_dir_listing(struct http_request_info *hri, DIR *dir, const char *path) {
+    struct dir_listing *dl = (struct dir_listing *)malloc(sizeof(struct dir_listing));
+    if (dl == NULL) {
+        closedir(dir);
+        return -1;
+    }
+    dl->dir = dir;
+    dl->entry = NULL;
+    dl->header_sent = 0;
+    strcpy(dl->uri, path);
+
+    return http_stream_send(hri, HttpStatusCodeOk,
+                            http_content_type_string(HttpContentType_TextHtml), -1,
+                            produce_dir_listing, release_dir_listing, dl);
+}
+
+/*
+ * Reject decoded paths which try to climb out of the root: ".." segments and
+ * backslashes, which some clients and proxies treat as separators.
+ */
+static int uri_path_allowed(const char *uri_path) {
+    if (strchr(uri_path, '\\') != NULL) return 0;
+    for (const char *p = uri_path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == uri_path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Resolve the decoded uri path against WEBBY_ROOT, following symlinks. Return
+ * the real path, to be freed by the caller, or NULL if it does not exist or lies
+ * outside WEBBY_ROOT.
+ */
+static char *resolve_resource_path(const char *uri_path) {
+    if (!uri_path_allowed(uri_path)) return NULL;
+
+    char *path = strconcat(WEBBY_ROOT, uri_path);
+    char *real = realpath(path, NULL);
     free(path);
+    if (real == NULL) return NULL;
 
-    char *ret_http_status = NULL;
+    size_t len = strlen(WEBBY_ROOT);
+    if (strncmp(real, WEBBY_ROOT, len) != 0 ||
+        (real[len] != '\0' && real[len] != '/' && WEBBY_ROOT[len - 1] != '/')) {
+        log_debug("Path outside of root: %s", real);
+        free(real);
+        return NULL;
+    }
+    return real;
+}
 
-    if (res == NULL) {
-        ret_http_status = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeNotFound);
-        int w =
-            send_response(fd, ret_http_status, http_content_type_string(HttpContentType_TextHtml),
-                          not_found_response, strlen(not_found_response));
+/**
+ * Send the resource at WEBBY_ROOT + hri->uri, or a listing if it is a directory.
+ * Anything which does not resolve to a path under WEBBY_ROOT is not found.
+ */
+int send_resource(struct http_request_info *hri, enum http_content_type type) {
+    char uri_path[MAX_URI];
+    DIR *dir = NULL;
+    FILE *res = NULL;
+
+    TRACE_BEGIN(file_open, hri->fd);
+    char *path = uri_decode(hri->uri, uri_path, sizeof(uri_path)) == 0
+                     ? resolve_resource_path(uri_path)
+                     : NULL;
+    if (path != NULL) {
+        dir = opendir(path);
+        if (dir == NULL) res = fopen(path, "r");
+        free(path);
+    }
+    TRACE_END(file_open, hri->fd, dir != NULL || res != NULL);
 
+    if (dir != NULL) return send_dir_listing(hri, dir, uri_path);
+
+    if (res == NULL) {
+        char *ret_http_status = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeNotFound);
+        int w = send_response(hri->fd, ret_http_status,
+                              http_content_type_string(HttpContentType_TextHtml),
+                              not_found_response, strlen(not_found_response));
         free(ret_http_status);
         return w;
     }
 
-    int w = send_file_content(fd, res, HttpContentType_TextHtml);
-    fclose(res);
-    return w;
+    return send_file_content(hri, res, type);
+}
+
+/**
+ * Send html response
+ */
+int send_html_response(int fd, struct http_request_info *hri) {
+    return send_resource(hri, HttpContentType_TextHtml);
 }
 
 /**
- * Send text file (chunked transfer not possible)
+ * Send text file
  */
 int send_text_response(int fd, struct http_request_info *hri) {
     if (strcmp(hri->uri, "/") == 0) {
@@ -192,22 +488,5 @@ int send_text_response(int fd, struct http_request_info *hri) {
         free(ret_http_status);
         return w;
     }
-    char *path = strconcat(WEBBY_ROOT, hri->uri);
-    FILE *res = fopen(path, "r");
-    free(path);
-
-    char *ret_http_status = NULL;
-
-    if (res == NULL) {
-        ret_http_status = build_http_status(HttpProtoHTTP_1_1, HttpStatusCodeNotFound);
-        int w =
-            send_response(fd, ret_http_status, http_content_type_string(HttpContentType_TextHtml),
-                          not_found_response, strlen(not_found_response));
-        free(ret_http_status);
-        return w;
-    }
-
-    int w = send_file_content(fd, res, HttpContentType_TextPlain);
-    fclose(res);
-    return w;
+    return send_resource(hri, HttpContentType_TextPlain);
 }
@@ -1,8 +1,11 @@
 #ifndef RESPONSES_H
 #define RESPONSES_H
 
+#include <stddef.h>
+
 #include "requests.h"
 
+int format_response_head(char *, size_t, const char *, char *, int);
 int send_response(int, const char *, char *, void *, int);
 
 enum http_method { GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH };
@@ -10,6 +13,7 @@ enum http_method { GET, HEAD, POST, PUT, DELETE, CONNECT, OPTIONS, TRACE, PATCH
 enum http_content_type {
     HttpContentType_TextHtml = 1,
     HttpContentType_TextPlain = 2,
+    HttpContentType_ApplicationJson = 3,
 };
 
 enum http_proto {
@@ -49,8 +53,10 @@ enum http_status_code {
     HttpStatusCodeHttpVersionNotSupported = 505
 };
 
+char *http_content_type_string(enum http_content_type);
 char *build_http_status(enum http_proto, enum http_status_code);
 
+int send_service_unavailable(int);
 int send_html_response(int, struct http_request_info *);
 /* int send_text_response(int, char*, struct http_request_info *); */
 int send_text_response(int, struct http_request_info *);
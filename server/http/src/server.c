@@ -1,4 +1,5 @@
 #include <arpa/inet.h>
+#include <errno.h>
 #include <error.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -8,22 +9,88 @@
 #include <stdlib.h>  // for exit
 #include <string.h>
 #include <sys/epoll.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
 #include "defaults.h"
 #include "logger.h"
 #include "requests.h"
 #include "response.h"
+#include "stream.h"
+#include "trace.h"
 #include "utils.h"
 
 int DEBUG_F = 0;
 char WEBBY_ROOT[MAX_BUFFER];
 
+/* Kept open so that a connection can still be accepted and dropped once fds run out */
+static int spare_fd = -1;
+static int accept_paused = 0;
+
 /*
  * Set the fd as non-blocking but keep the existing options
  */
 void setnonblocking(int fd) { fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); }
 
+/*
+ * Watch fd for writability so that a parked stream can be resumed.
+ */
+int rearm_for_write(int epollfd, int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+    return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * Answer a connection which will not be served with a 503 and close it. Whatever
+ * part of the request already arrived is read first, so that closing does not
+ * reset the connection before the client sees the 503.
+ */
+void reject_connection(int connfd) {
+    char buf[MAX_BUFFER];
+    while (recv(connfd, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+    }
+    if (send_service_unavailable(connfd) < 0) {
+        log_debug("Error sending service unavailable response");
+    }
+    close(connfd);
+}
+
+/*
+ * accept() failed for lack of fds, so the pending connection stays in the backlog
+ * and the level-triggered listen socket keeps waking the loop. Give up the spare fd
+ * to take the connection off the backlog and reject it. Without a spare fd, stop
+ * watching the listen socket until a connection is closed.
+ */
+void accept_out_of_fds(int epollfd, int sockfd) {
+    if (spare_fd != -1) {
+        log_error("Out of file descriptors, rejecting incoming connection");
+        close(spare_fd);
+        int connfd = accept(sockfd, NULL, NULL);
+        if (connfd != -1) reject_connection(connfd);
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        return;
+    }
+
+    log_error("Out of file descriptors, pausing accept");
+    struct epoll_event ev = {.events = 0, .data.fd = sockfd};
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &ev) == 0) accept_paused = 1;
+}
+
+/*
+ * Watch the listen socket again once a connection gave its fd back.
+ */
+void resume_accept(int epollfd, int sockfd) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = sockfd};
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, sockfd, &ev) == 0) {
+        accept_paused = 0;
+        if (spare_fd == -1) spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        log_info("Resuming accept");
+    }
+}
+
 /**
  * Simple signal handler.
  * Log an message and exit with EXIT_SUCCESS.
@@ -34,7 +101,14 @@ void termination_handler(int signum) {
 }
 
 /**
- * Signal handler which should handle both SIGINT and SIGTERM.
+ * Ask the event loop to dump the trace ring. The dump itself is not
+ * async-signal-safe so it happens outside of the handler.
+ */
+void trace_dump_handler(int signum) { TRACE_DUMP_F = 1; }
+
+/**
+ * Signal handler which should handle both SIGINT and SIGTERM,
+ * and SIGUSR1 for dumping the trace ring.
  */
 void setup_signal_handler() {
     struct sigaction new_action, old_action;
@@ -51,6 +125,9 @@ void setup_signal_handler() {
         sigaction(SIGINT, &new_action, NULL);
         sigaction(SIGTERM, &new_action, NULL);
     }
+
+    new_action.sa_handler = trace_dump_handler;
+    sigaction(SIGUSR1, &new_action, NULL);
 }
 
 /**
@@ -78,6 +155,12 @@ int setup_socket(int port) {
         exit(EXIT_FAILURE);
     }
 
+    // Receive timestamps tell how long a request waited before being read,
+    // accepted sockets inherit the option
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &opt, sizeof(opt)) < 0) {
+        log_debug("Could not enable receive timestamps, queue delay will not be measured");
+    }
+
     // Binding socket to an addr
     struct sockaddr_in host_addr;
     int host_addrlen = sizeof(host_addr);
@@ -102,68 +185,79 @@ int setup_socket(int port) {
 }
 
 /**
- * Naive implementation for reading all headers
+ * Read a request from connfd into buf.
  *
- * @read_buffer: buffer to read from
- * @start      : index to start reading from
- * @stop       : max index to read until
+ * @delay_ns: set to how long the request waited in the socket before being
+ *            read, from its receive timestamp, or -1 when that is not known
  */
-void read_all_headers(char *read_buffer, int start, int stop) {
-    char buf[MAX_BUFFER];
-
-    char k[MAX_BUFFER], v[MAX_BUFFER];
-    int key_found = 0;
-
-    memset(buf, 0, sizeof(char) * MAX_BUFFER);
-
-    for (int i = start, j = 0; i < stop; i++) {
-        if ((read_buffer[i - 1] == '\r') && (read_buffer[i] == '\n')) {
-            memset(v, '\0', sizeof(char) * MAX_BUFFER);
-            if (strlen(buf) > 0)
-                strcpy(v, buf);
-            else
-                continue;  // nothing in buf to copy
-            log_debug("Header: %s => %s", k, v);
-            memset(buf, '\0', sizeof(char) * MAX_BUFFER);
-            key_found = 0, j = 0;
-            if ((read_buffer[i] == '\n') && (read_buffer[i + 1] == '\r')) {
-                break;
-            }
-            continue;
-        }
-        buf[j++] = read_buffer[i];
-        if ((buf[j - 1] == ':') && !key_found) {
-            memset(k, '\0', sizeof(char) * MAX_BUFFER);
-            strcpy(k, buf);
-            key_found = 1, j = 0, i++;
-            memset(buf, '\0', sizeof(char) * MAX_BUFFER);
+ssize_t read_request(int connfd, char *buf, size_t len, int64_t *delay_ns) {
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof(control)};
+
+    *delay_ns = -1;
+    ssize_t r = recvmsg(connfd, &msg, 0);
+    if (r <= 0) return r;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+            struct timespec rx, now;
+            memcpy(&rx, CMSG_DATA(cmsg), sizeof(rx));
+            clock_gettime(CLOCK_REALTIME, &now);
+            *delay_ns = (int64_t)(now.tv_sec - rx.tv_sec) * 1000000000 + now.tv_nsec - rx.tv_nsec;
+            if (*delay_ns < 0) *delay_ns = 0;
         }
     }
+    return r;
 }
 
-int handle_client(int connfd) {
+/**
+ * Read and answer one request on connfd.
+ *
+ * @start_ns: when the request span started, carried along by parked responses
+ */
+int handle_client(int connfd, uint64_t start_ns) {
     char read_buffer[MAX_BUFFER] = {0};
-    ssize_t r = read(connfd, read_buffer, MAX_BUFFER);
+    int64_t delay_ns;
+    TRACE_BEGIN(read, connfd);
+    ssize_t r = read_request(connfd, read_buffer, MAX_BUFFER - 1, &delay_ns);
+    TRACE_END(read, connfd, r);
     if (r < 0) {
         log_error("Error reading from sock");
         return 1;
     }
     log_debug("Read bytes: %ld", r);
 
+    if (admission_request(connfd, delay_ns) != AdmissionAdmit) {
+        log_debug("Shedding request, queue delay: %ldus", delay_ns / 1000);
+        if (send_service_unavailable(connfd) < 0) {
+            log_error("Error sending service unavailable response");
+            return 1;
+        }
+        return 0;
+    }
+
     struct http_request_info hri;
     hri.fd = connfd;
-    sscanf(read_buffer, "%s %s %s", hri.method, hri.uri, hri.proto);
+    hri.start_ns = start_ns;
+    TRACE_BEGIN(parse, connfd);
+    int headers_start = parse_request_line(read_buffer, &hri);
 
     if (DEBUG_F) {
-        int total_len = strlen(hri.method) + strlen(hri.uri) + strlen(hri.proto);
-        read_all_headers(read_buffer, total_len + 4, r);
+        read_all_headers(read_buffer, headers_start, r);
     }
+    TRACE_END(parse, connfd, r);
 
     log_debug("Request info: method: %s uri: %s proto: %s", hri.method, hri.uri, hri.proto);
     int w;
     if (strcmp(hri.method, "GET") == 0) {
         // handle get request
-        if (strstr(hri.uri, ".html") != NULL) {
+        if (TRACE_F && strcmp(hri.uri, TRACE_ROUTE) == 0) {
+            w = send_trace_response(&hri);
+        } else if (strstr(hri.uri, ".html") != NULL) {
             w = send_html_response(connfd, &hri);
         } else {
             w = send_text_response(connfd, &hri);
@@ -183,8 +277,13 @@ void usage(char *bin) {
     printf("Options:\n");
     printf("  -h, --help\t\tdisplay this help message\n");
     printf("  -d, --debug\t\tprint debug logs\n");
+    printf("  -t, --trace\t\trecord request spans, dump with SIGUSR1 or GET %s\n", TRACE_ROUTE);
     printf("  -v, --version\t\tprint version number and exit\n");
     printf("  -p, --port <port>\tset the port number (default: 9090)\n");
+    printf("  -c, --max-connections <n>\n");
+    printf("\t\t\tconnections with a request in flight before answering 503 (default: %d)\n",
+           MAX_CONNECTIONS);
+    printf("  -r, --rate-limit <n>\trequests per second per client IP, 0 for none (default: 0)\n");
 }
 // Print version
 void version() { printf("%s v%s\n", APP_NAME, APP_VERSION); }
@@ -192,21 +291,26 @@ void version() { printf("%s v%s\n", APP_NAME, APP_VERSION); }
 int main(int argc, char *argv[]) {
     int c;
     uint16_t port = DEFAULT_PORT;
+    int max_connections = MAX_CONNECTIONS;
+    int rate_limit = 0;
 
     // clang-format off
     static struct option long_options[] = {
-        {"help",    no_argument,       0, 'h'},
-        {"debug",   no_argument,       0, 'd'},
-        {"version", no_argument,       0, 'v'},
-        {"port",    required_argument, 0, 'p'},
-        {0,         0,                 0,  0 }
+        {"help",            no_argument,       0, 'h'},
+        {"debug",           no_argument,       0, 'd'},
+        {"trace",           no_argument,       0, 't'},
+        {"version",         no_argument,       0, 'v'},
+        {"port",            required_argument, 0, 'p'},
+        {"max-connections", required_argument, 0, 'c'},
+        {"rate-limit",      required_argument, 0, 'r'},
+        {0,                 0,                 0,  0 }
     };
     // clang-format on
 
     while (1) {
         int option_index = 0;
 
-        c = getopt_long(argc, argv, "hvdp:0", long_options, &option_index);
+        c = getopt_long(argc, argv, "hvdtp:c:r:0", long_options, &option_index);
 
         if (c == -1) break;
 
@@ -220,9 +324,18 @@ int main(int argc, char *argv[]) {
             case 'd':
                 DEBUG_F = 1;
                 break;
+            case 't':
+                TRACE_F = 1;
+                break;
             case 'p':
                 port = strtol(optarg, NULL, 10);
                 break;
+            case 'c':
+                max_connections = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rate_limit = strtol(optarg, NULL, 10);
+                break;
             case '?':
                 usage(argv[0]);
                 exit(EXIT_FAILURE);
@@ -234,11 +347,20 @@ int main(int argc, char *argv[]) {
     setup_webby_root(WEBBY_ROOT);
     setup_signal_handler();
 
+    if (TRACE_F && trace_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (admission_init(max_connections, rate_limit) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     log_info("Starting %s v%s", APP_NAME, APP_VERSION);
 
     if (port == DEFAULT_PORT) log_info("Using default port: %d", port);
 
     int sockfd = setup_socket(port);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     struct epoll_event ev, events[MAX_EVENTS];
     int nfds;
@@ -262,16 +384,32 @@ int main(int argc, char *argv[]) {
 
     for (;;) {
         nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        if (TRACE_DUMP_F) {
+            TRACE_DUMP_F = 0;
+            trace_dump_file();
+        }
         if (nfds == -1) {
+            if (errno == EINTR) continue;
             log_error("epoll_wait: nfds:");
             exit(EXIT_FAILURE);
         }
         for (int n = 0; n < nfds; n++) {
             if (events[n].data.fd == sockfd) {
+                TRACE_BEGIN(accept, sockfd);
                 int connfd =
                     accept(sockfd, (struct sockaddr *)&host_addr, (socklen_t *)&host_addrlen);
+                TRACE_END(accept, connfd, sockfd);
                 if (connfd == -1) {
-                    log_error("Error accepting incoming connection");
+                    if (errno == EMFILE || errno == ENFILE) {
+                        accept_out_of_fds(epollfd, sockfd);
+                    } else {
+                        log_error("Error accepting incoming connection");
+                    }
+                    continue;
+                }
+                // a shed connection still gets its request read, then answered with a 503
+                if (admission_accept(connfd, &host_addr) == AdmissionReject) {
+                    reject_connection(connfd);
                     continue;
                 }
                 setnonblocking(connfd);
@@ -283,20 +421,49 @@ int main(int argc, char *argv[]) {
                 }
             } else {
                 int connfd = events[n].data.fd;
-                int sockname = getsockname(connfd, (struct sockaddr *)&client_addr,
-                                           (socklen_t *)&client_addrlen);
-                if (sockname < 0) {
-                    log_error("Error reading client addr");
-                    return 1;
-                }
-                log_debug("Accepted new incoming connection from: %s",
-                          inet_ntoa(client_addr.sin_addr));
+                struct http_stream *stream = http_stream_find(connfd);
+                if (stream != NULL) {
+                    // socket became writable again, carry on with the parked stream
+                    enum http_stream_status st = http_stream_resume(stream);
+                    if (st == HttpStreamPending && rearm_for_write(epollfd, connfd) == 0) {
+                        continue;
+                    }
+                    if (st == HttpStreamError) {
+                        log_error("Error streaming response");
+                    }
+                    http_stream_free(stream);
+                } else {
+                    int sockname = getsockname(connfd, (struct sockaddr *)&client_addr,
+                                               (socklen_t *)&client_addrlen);
+                    if (sockname < 0) {
+                        log_error("Error reading client addr");
+                        return 1;
+                    }
+                    log_debug("Accepted new incoming connection from: %s",
+                              inet_ntoa(client_addr.sin_addr));
 
-                if (handle_client(connfd) != 0) {
-                    log_error("Error handling client");
+                    uint64_t request_start_ns;
+                    TRACE_BEGIN_AT(request, connfd, request_start_ns);
+                    if (handle_client(connfd, request_start_ns) != 0) {
+                        log_error("Error handling client");
+                    }
+
+                    // a parked response ends the request span when its stream is freed
+                    stream = http_stream_find(connfd);
+                    if (stream != NULL) {
+                        if (rearm_for_write(epollfd, connfd) == 0) {
+                            continue;
+                        }
+                        log_error("epoll_ctl: connfd");
+                        http_stream_free(stream);
+                    } else {
+                        TRACE_END_AT(request, connfd, request_start_ns, 0);
+                    }
                 }
 
                 // Close connfd
+                admission_release(connfd);
+                if (accept_paused) resume_accept(epollfd, sockfd);
                 if (close(connfd) != 0) {
                     log_error("Error closing connection");
                     if (fsync(connfd) != 0) {
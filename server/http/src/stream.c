@@ -0,0 +1,304 @@
+#include "stream.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Streams waiting for the socket to become writable, indexed by fd */
+static struct http_stream **parked_streams = NULL;
+static int parked_streams_len = 0;
+
+/**
+ * Move the coalesced body bytes into the output window, adding the chunk
+ * size line and trailer when the stream uses chunked framing.
+ */
+static void stream_frame(struct http_stream *s, int last) {
+    size_t len = s->data_len;
+
+    s->out_start = STREAM_HEADROOM;
+    s->out_end = STREAM_HEADROOM + len;
+
+    if (s->framing == HttpStreamFramingChunked) {
+        if (len > 0) {
+            char size_line[STREAM_HEADROOM];
+            int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+
+            s->out_start -= n;
+            memcpy(s->buf + s->out_start, size_line, n);
+            memcpy(s->buf + s->out_end, "\r\n", 2);
+            s->out_end += 2;
+        }
+        if (last) {
+            memcpy(s->buf + s->out_end, "0\r\n\r\n", 5);
+            s->out_end += 5;
+        }
+    }
+    s->data_len = 0;
+    s->flushing = 1;
+}
+
+/**
+ * Send whatever is left of the headers and the output window.
+ *
+ * Return 0 once everything is sent, 1 if the socket would block and -1 on error.
+ */
+static int stream_drain(struct http_stream *s) {
+    while (s->head_off < s->head_len || s->out_start < s->out_end) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+
+        if (s->head_off < s->head_len) {
+            iov[iovcnt].iov_base = s->head + s->head_off;
+            iov[iovcnt++].iov_len = s->head_len - s->head_off;
+        }
+        if (s->out_start < s->out_end) {
+            iov[iovcnt].iov_base = s->buf + s->out_start;
+            iov[iovcnt++].iov_len = s->out_end - s->out_start;
+        }
+
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        TRACE_BEGIN(send, s->fd);
+        ssize_t w = sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+        TRACE_END(send, s->fd, w);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            log_error("Error sending stream on fd: %d", s->fd);
+            return -1;
+        }
+        s->sent += w;
+
+        size_t h = s->head_len - s->head_off;
+        if ((size_t)w < h) h = w;
+        s->head_off += h;
+        s->out_start += w - h;
+    }
+    s->flushing = 0;
+    return 0;
+}
+
+/**
+ * Frame the coalesced bytes and try to put them on the wire right away.
+ */
+static void stream_flush(struct http_stream *s) {
+    stream_frame(s, 0);
+    if (stream_drain(s) < 0) s->failed = 1;
+}
+
+/**
+ * Run the producer until the body is complete or the socket pushes back.
+ */
+static enum http_stream_status stream_pump(struct http_stream *s) {
+    for (;;) {
+        if (s->flushing) {
+            int r = stream_drain(s);
+            if (r < 0) return HttpStreamError;
+            if (r > 0) return HttpStreamPending;
+        }
+        if (s->failed) return HttpStreamError;
+        if (s->finished) return HttpStreamDone;
+
+        if (s->data_len == STREAM_CHUNK_SIZE) {
+            stream_frame(s, 0);
+            continue;
+        }
+
+        enum http_stream_status st = s->produce(s, s->ctx);
+        if (st == HttpStreamError || s->failed) return HttpStreamError;
+        if (st == HttpStreamDone) {
+            stream_frame(s, 1);
+            s->finished = 1;
+        }
+    }
+}
+
+/**
+ * Remaining space in the current chunk. Zero while a chunk is still being sent.
+ */
+size_t http_stream_room(struct http_stream *s) {
+    if (s->flushing || s->failed) return 0;
+    return STREAM_CHUNK_SIZE - s->data_len;
+}
+
+/**
+ * Append body bytes to the stream. Small writes are coalesced into chunks of
+ * STREAM_CHUNK_SIZE bytes.
+ *
+ * Return the number of bytes taken, which is short when the socket pushes back.
+ * The producer should then return HttpStreamMore and retry the rest later.
+ */
+size_t http_stream_write(struct http_stream *s, const void *data, size_t len) {
+    size_t done = 0;
+
+    while (done < len && !s->flushing && !s->failed) {
+        size_t room = http_stream_room(s);
+        if (room == 0) {
+            stream_flush(s);
+            continue;
+        }
+        size_t n = len - done < room ? len - done : room;
+        memcpy(s->buf + STREAM_HEADROOM + s->data_len, (const char *)data + done, n);
+        s->data_len += n;
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Append one formatted record to the stream. The record is either taken whole
+ * or not at all, in which case 0 is returned and the producer should retry it
+ * later. Records must be shorter than STREAM_CHUNK_SIZE.
+ */
+size_t http_stream_printf(struct http_stream *s, const char *fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = http_stream_room(s);
+        if (room == 0) return 0;
+
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(s->buf + STREAM_HEADROOM + s->data_len, room, fmt, args);
+        va_end(args);
+
+        if (n < 0 || n >= STREAM_CHUNK_SIZE) {
+            log_error("Stream record too large: %d bytes", n);
+            s->failed = 1;
+            return 0;
+        }
+        if ((size_t)n < room) {
+            s->data_len += n;
+            return n;
+        }
+        stream_flush(s);
+    }
+    return 0;
+}
+
+/**
+ * Keep the stream around until its fd becomes writable again.
+ */
+static int stream_park(struct http_stream *s) {
+    if (parked_streams == NULL) {
+        int size = fd_table_size();
+        parked_streams = (struct http_stream **)calloc(size, sizeof(struct http_stream *));
+        if (parked_streams == NULL) {
+            log_error("Could not allocate parked streams table");
+            return -1;
+        }
+        parked_streams_len = size;
+    }
+    if (s->fd < 0 || s->fd >= parked_streams_len) return -1;
+    parked_streams[s->fd] = s;
+    return 0;
+}
+
+/**
+ * Start a streaming response on hri->fd. The body is pulled from produce; when
+ * content_length is negative it is sent chunked to HTTP/1.1 clients and
+ * delimited by closing the connection for older ones.
+ *
+ * If the socket pushes back the stream is parked and the event loop resumes it
+ * through http_stream_find() and http_stream_resume(); a stream which can not be
+ * parked fails rather than block the loop. release is called with
+ * ctx once the stream is done, whatever the outcome.
+ *
+ * Return 0 once the response is sent or parked, -1 on error.
+ */
+int http_stream_send(struct http_request_info *hri, enum http_status_code status,
+                     const char *content_type, long content_length, http_stream_producer produce,
+                     http_stream_release release, void *ctx) {
+    struct http_stream *s = (struct http_stream *)malloc(sizeof(struct http_stream));
+    if (s == NULL) {
+        log_error("Could not allocate stream");
+        if (release != NULL) release(ctx);
+        return -1;
+    }
+    memset(s, 0, offsetof(struct http_stream, head));
+    s->fd = hri->fd;
+    s->request_start_ns = hri->start_ns;
+    s->produce = produce;
+    s->release = release;
+    s->ctx = ctx;
+    s->data_len = 0;
+    s->out_start = s->out_end = 0;
+    s->head_off = 0;
+
+    if (content_length >= 0) {
+        s->framing = HttpStreamFramingLength;
+    } else if (strcmp(hri->proto, "HTTP/1.1") == 0) {
+        s->framing = HttpStreamFramingChunked;
+    } else {
+        s->framing = HttpStreamFramingClose;
+    }
+
+    char *http_status = build_http_status(HttpProtoHTTP_1_1, status);
+    char *server_date = get_server_date();
+
+    int n = snprintf(s->head, sizeof(s->head),
+                     "%s\r\n"
+                     "Date: %s\r\n"
+                     "Server: %s\r\n"
+                     "Content-Type: %s\r\n",
+                     http_status, server_date, APP_NAME, content_type);
+    switch (s->framing) {
+        case HttpStreamFramingLength:
+            n += snprintf(s->head + n, sizeof(s->head) - n, "Content-Length: %ld\r\n\r\n",
+                          content_length);
+            break;
+        case HttpStreamFramingChunked:
+            n += snprintf(s->head + n, sizeof(s->head) - n,
+                          "Transfer-Encoding: chunked\r\n\r\n");
+            break;
+        default:
+            n += snprintf(s->head + n, sizeof(s->head) - n, "Connection: close\r\n\r\n");
+    }
+    s->head_len = n;
+    free(http_status);
+    free(server_date);
+
+    enum http_stream_status st = stream_pump(s);
+    if (st == HttpStreamPending) {
+        if (stream_park(s) == 0) return 0;
+        // waiting on this one client would stall the whole event loop, give up on it instead
+        log_error("Could not park stream on fd: %d", s->fd);
+        st = HttpStreamError;
+    }
+
+    http_stream_free(s);
+    return st == HttpStreamError ? -1 : 0;
+}
+
+/**
+ * Return the stream parked on fd, if any.
+ */
+struct http_stream *http_stream_find(int fd) {
+    if (fd < 0 || fd >= parked_streams_len) return NULL;
+    return parked_streams[fd];
+}
+
+/**
+ * Continue a parked stream once its socket is writable. HttpStreamPending means
+ * the fd has to be watched for writability again; otherwise the caller frees the
+ * stream and closes the connection.
+ */
+enum http_stream_status http_stream_resume(struct http_stream *s) { return stream_pump(s); }
+
+/**
+ * Unpark the stream, release the producer context and free it. A parked stream
+ * outlived handle_client(), so this is where its request span ends.
+ */
+void http_stream_free(struct http_stream *s) {
+    if (http_stream_find(s->fd) == s) {
+        parked_streams[s->fd] = NULL;
+        TRACE_END_AT(request, s->fd, s->request_start_ns, s->sent);
+    }
+    if (s->release != NULL) s->release(s->ctx);
+    free(s);
+}
@@ -0,0 +1,73 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defaults.h"
+#include "requests.h"
+#include "response.h"
+
+#define STREAM_CHUNK_SIZE 16384
+#define STREAM_HEADROOM 16  // room for the "<hex>\r\n" chunk size line
+#define STREAM_TRAILER 8    // room for "\r\n" plus the final "0\r\n\r\n"
+
+enum http_stream_status {
+    HttpStreamError = -1,
+    HttpStreamDone = 0,
+    HttpStreamMore = 1,
+    HttpStreamPending = 2,
+};
+
+enum http_stream_framing {
+    HttpStreamFramingLength = 1,   // Content-Length known up front
+    HttpStreamFramingChunked = 2,  // HTTP/1.1 Transfer-Encoding: chunked
+    HttpStreamFramingClose = 3,    // HTTP/1.0, body ends when the connection closes
+};
+
+struct http_stream;
+
+/*
+ * Called whenever the stream can take more body bytes. Return HttpStreamMore to be
+ * called again, HttpStreamDone once the body is complete or HttpStreamError to abort.
+ */
+typedef enum http_stream_status (*http_stream_producer)(struct http_stream *, void *);
+typedef void (*http_stream_release)(void *);
+
+struct http_stream {
+    int fd;
+    enum http_stream_framing framing;
+    int finished;
+    int failed;
+    int flushing;  // output window (and headers) not yet on the wire
+    long sent;
+    uint64_t request_start_ns;  // request span ends when a parked stream is freed
+
+    http_stream_producer produce;
+    http_stream_release release;
+    void *ctx;
+
+    char head[MAX_BUFFER];
+    size_t head_len;
+    size_t head_off;
+
+    // body bytes are coalesced at buf + STREAM_HEADROOM until a chunk is full
+    char buf[STREAM_HEADROOM + STREAM_CHUNK_SIZE + STREAM_TRAILER];
+    size_t data_len;
+    size_t out_start;
+    size_t out_end;
+};
+
+int http_stream_send(struct http_request_info *, enum http_status_code, const char *, long,
+                     http_stream_producer, http_stream_release, void *);
+
+size_t http_stream_write(struct http_stream *, const void *, size_t);
+size_t http_stream_printf(struct http_stream *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
+size_t http_stream_room(struct http_stream *);
+
+struct http_stream *http_stream_find(int);
+enum http_stream_status http_stream_resume(struct http_stream *);
+void http_stream_free(struct http_stream *);
+
+#endif /* STREAM_H */
@@ -0,0 +1,157 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "logger.h"
+#include "requests.h"
+#include "response.h"
+#include "stream.h"
+#include "utils.h"
+
+static const char *SPAN_STRING[] = {FOREACH_SPAN(GENERATE_SPAN_STRING)};
+
+int TRACE_F = 0;
+volatile sig_atomic_t TRACE_DUMP_F = 0;
+
+/*
+ * Ring buffer of the most recent spans. The server runs a single event loop,
+ * so one ring per process is one ring per worker.
+ */
+static struct trace_event *trace_ring = NULL;
+static uint64_t trace_head = 0;
+
+/**
+ * Allocate the ring buffer. Return -1 if that is not possible.
+ */
+int trace_init() {
+    trace_ring = (struct trace_event *)calloc(TRACE_RING_SIZE, sizeof(struct trace_event));
+    if (trace_ring == NULL) {
+        log_error("Could not allocate trace ring");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Monotonic time in nanoseconds
+ */
+uint64_t trace_now() { return monotonic_ns(); }
+
+/**
+ * Record a span which started at start_ns and ends now, overwriting the
+ * oldest span once the ring is full.
+ */
+void trace_record(enum trace_span span, int fd, uint64_t start_ns, long arg) {
+    if (trace_ring == NULL) return;
+
+    struct trace_event *ev = &trace_ring[trace_head++ & (TRACE_RING_SIZE - 1)];
+    ev->start_ns = start_ns;
+    ev->dur_ns = trace_now() - start_ns;
+    ev->arg = arg;
+    ev->fd = fd;
+    ev->span = span;
+}
+
+/**
+ * Format one span as a Chrome trace-event complete ("X") event.
+ *
+ * Return the length of the formatted event.
+ */
+int trace_format_event(char *buf, size_t size, const struct trace_event *ev) {
+    int pid = getpid();
+    return snprintf(buf, size,
+                    "{\"name\":\"%s\",\"cat\":\"webby\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"fd\":%d,\"arg\":%ld}}",
+                    SPAN_STRING[ev->span], ev->start_ns / 1000.0, ev->dur_ns / 1000.0, pid, pid,
+                    ev->fd, ev->arg);
+}
+
+/*
+ * Oldest span still in the ring
+ */
+static uint64_t trace_tail() {
+    return trace_head > TRACE_RING_SIZE ? trace_head - TRACE_RING_SIZE : 0;
+}
+
+/**
+ * Write the ring buffer as Chrome trace-event JSON to webby-trace-<pid>.json
+ * in the working directory. The file can be opened in Perfetto or chrome://tracing.
+ */
+int trace_dump_file() {
+    if (trace_ring == NULL) return -1;
+
+    char path[MAX_BUFFER];
+    snprintf(path, sizeof(path), "webby-trace-%d.json", getpid());
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        log_error("Could not open trace file: %s", path);
+        return -1;
+    }
+
+    char event[MAX_BUFFER];
+    fprintf(f, "{\"traceEvents\":[");
+    for (uint64_t i = trace_tail(); i < trace_head; i++) {
+        trace_format_event(event, sizeof(event), &trace_ring[i & (TRACE_RING_SIZE - 1)]);
+        fprintf(f, "%s%s\n", i == trace_tail() ? "" : ",", event);
+    }
+    fprintf(f, "]}\n");
+    fclose(f);
+
+    log_info("Dumped %lu trace events to %s", trace_head - trace_tail(), path);
+    return 0;
+}
+
+struct trace_dump {
+    uint64_t next;
+    uint64_t end;
+    int header_sent;
+    int emitted;
+};
+
+/*
+ * Stream the spans which were in the ring when the request came in. Spans which
+ * get overwritten while the response is being sent are skipped.
+ */
+static enum http_stream_status produce_trace(struct http_stream *s, void *ctx) {
+    struct trace_dump *td = (struct trace_dump *)ctx;
+    char event[MAX_BUFFER];
+
+    if (!td->header_sent) {
+        if (http_stream_printf(s, "{\"traceEvents\":[") == 0) return HttpStreamMore;
+        td->header_sent = 1;
+    }
+
+    if (td->next < trace_tail()) td->next = trace_tail();
+    if (td->next >= td->end) {
+        if (http_stream_printf(s, "]}\n") == 0) return HttpStreamMore;
+        return HttpStreamDone;
+    }
+
+    trace_format_event(event, sizeof(event), &trace_ring[td->next & (TRACE_RING_SIZE - 1)]);
+    if (http_stream_printf(s, "%s%s\n", td->emitted ? "," : "", event) == 0) return HttpStreamMore;
+    td->next++;
+    td->emitted++;
+    return HttpStreamMore;
+}
+
+/**
+ * Send the ring buffer as Chrome trace-event JSON
+ */
+int send_trace_response(struct http_request_info *hri) {
+    struct trace_dump *td = (struct trace_dump *)malloc(sizeof(struct trace_dump));
+    if (td == NULL) return -1;
+
+    td->next = trace_tail();
+    td->end = trace_head;
+    td->header_sent = 0;
+    td->emitted = 0;
+
+    return http_stream_send(hri, HttpStatusCodeOk,
+                            http_content_type_string(HttpContentType_ApplicationJson), -1,
+                            produce_trace, free, td);
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_RING_SIZE 65536  // spans kept in memory, must be a power of two
+
+/*
+ * Spans recorded along the request path. Each span also gets a pair of static
+ * USDT probes, webby:<span>__start and webby:<span>__done, for bpftrace/perf.
+ */
+#define FOREACH_SPAN(SPAN) \
+    SPAN(accept)           \
+    SPAN(request)          \
+    SPAN(read)             \
+    SPAN(parse)            \
+    SPAN(file_open)        \
+    SPAN(file_read)        \
+    SPAN(send)
+
+#define GENERATE_SPAN_ENUM(SPAN) trace_span_##SPAN,
+#define GENERATE_SPAN_STRING(SPAN) #SPAN,
+
+enum trace_span { FOREACH_SPAN(GENERATE_SPAN_ENUM) };
+
+struct trace_event {
+    uint64_t start_ns;
+    uint64_t dur_ns;
+    long arg;
+    int fd;
+    enum trace_span span;
+};
+
+extern int TRACE_F;
+extern volatile sig_atomic_t TRACE_DUMP_F;
+
+int trace_init();
+uint64_t trace_now();
+void trace_record(enum trace_span, int, uint64_t, long);
+int trace_format_event(char *, size_t, const struct trace_event *);
+int trace_dump_file();
+
+struct http_request_info;
+int send_trace_response(struct http_request_info *);
+
+/*
+ * USDT probes compile to a single nop when nothing is attached. Without
+ * <sys/sdt.h> (systemtap-sdt-dev) they compile to nothing at all.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(WEBBY_NO_USDT)
+#include <sys/sdt.h>
+#define WEBBY_PROBE(name, ...) STAP_PROBEV(webby, name, __VA_ARGS__)
+#endif
+#endif
+
+#ifndef WEBBY_PROBE
+#define WEBBY_PROBE(name, ...) \
+    do {                       \
+    } while (0)
+#endif
+
+/*
+ * Mark the start and the end of a span. Both have to be used in the same scope.
+ * arg is span specific, typically the number of bytes read or sent.
+ */
+#define TRACE_BEGIN(name, fd)                                  \
+    uint64_t trace_##name##_start = TRACE_F ? trace_now() : 0; \
+    WEBBY_PROBE(name##__start, fd)
+
+#define TRACE_END(name, fd, arg) TRACE_END_AT(name, fd, trace_##name##_start, arg)
+
+/*
+ * Same for a span which ends in another scope than it started, such as a request
+ * whose response outlives handle_client(). The start time is kept in start_ns.
+ */
+#define TRACE_BEGIN_AT(name, fd, start_ns)      \
+    do {                                        \
+        (start_ns) = TRACE_F ? trace_now() : 0; \
+        WEBBY_PROBE(name##__start, fd);         \
+    } while (0)
+
+#define TRACE_END_AT(name, fd, start_ns, arg)                            \
+    do {                                                                 \
+        WEBBY_PROBE(name##__done, fd, arg);                              \
+        if (TRACE_F) trace_record(trace_span_##name, fd, start_ns, arg); \
+    } while (0)
+
+#endif /* TRACE_H */
@@ -3,8 +3,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <time.h>
 
+#include "defaults.h"
+
 /**
  * Returns local server date time
  *
@@ -36,7 +39,7 @@ char *get_server_date() {
 }
 
 /**
- * Setup the root location of the website
+ * Setup the root location of the website, as an absolute path without symlinks
  */
 void setup_webby_root(char *w) {
     char *wbr = getenv("WEBBY_ROOT");
@@ -44,5 +47,32 @@ void setup_webby_root(char *w) {
         fprintf(stderr, "Please set WEBBY_ROOT environment variable\n");
         exit(EXIT_FAILURE);
     }
-    strcpy(w, wbr);
+
+    // resolved once, so resources can be checked to stay under it
+    char *real = realpath(wbr, NULL);
+    if (real == NULL || strlen(real) >= MAX_BUFFER) {
+        fprintf(stderr, "WEBBY_ROOT is not a valid path: %s\n", wbr);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(w, real);
+    free(real);
+}
+
+/**
+ * Returns monotonic time in nanoseconds
+ */
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Returns the number of entries a table indexed by fd needs. fds can not go
+ * above the open files limit, an unlimited one is capped at MAX_FD_TABLE.
+ */
+int fd_table_size() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur > MAX_FD_TABLE) return MAX_FD_TABLE;
+    return rl.rlim_cur;
 }
@@ -1,10 +1,16 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
+
 char *get_time();
 
 char *get_server_date();
 
 void setup_webby_root(char *);
 
+uint64_t monotonic_ns();
+
+int fd_table_size();
+
 #endif /* LOG_H */